@@ -8,6 +8,7 @@ import (
     "io"
     "os"
     "encoding/hex"
+    "strconv"
 )
 
 type ApiServer struct {
@@ -227,6 +228,7 @@ func (s *ApiServer) GetArtist(res http.ResponseWriter, req *http.Request) {
 // handles getCoveArt.view requests
 func (s *ApiServer) GetCoverArt(res http.ResponseWriter, req *http.Request) {
     var id          string
+    var size        int
     var coverArt    []byte
     var err         error
 
@@ -234,7 +236,16 @@ func (s *ApiServer) GetCoverArt(res http.ResponseWriter, req *http.Request) {
         s.writeSubsonicResponse(res, req, NewSubsonicError(10, "id parameter missing"))
     } else {
         id = req.Form["id"][0]
-        coverArt, err = s.db.GetCoverArt(id); if err != nil {
+
+        // size is optional, ignore anything we can't make sense of and
+        // serve the original image
+        if len(req.Form["size"]) == 1 {
+            size, err = strconv.Atoi(req.Form["size"][0]); if err != nil {
+                size = 0
+            }
+        }
+
+        coverArt, err = s.db.GetCoverArt(id, size); if err != nil {
             s.logger.Print("failed to get covert art:", err)
             s.writeSubsonicResponse(res, req, NewSubsonicError(0, "internal server error"))
         } else if len(coverArt) > 0 {
@@ -17,6 +17,7 @@ type SubsonicDB struct {
     db          *sql.DB
     dbpath      string
     statements  []*sql.Stmt
+    snapshots   *SnapshotStore
 }
 
 const (
@@ -34,6 +35,12 @@ const (
     GETMTIME        = iota
 )
 
+// picks the album whose cover stands for an artist. both original and
+// pre-scaled artist art must come from the same album.
+const ARTISTCOVERALBUM = `SELECT albumId FROM covers WHERE artistId=?
+                          AND image NOT NULL AND length(image) > 0
+                          ORDER BY albumId ASC LIMIT 1`
+
 // creates a new SubsonicDB store
 func NewSubsonicDB(dbpath string) (sdb *SubsonicDB) {
     sdb = &SubsonicDB{
@@ -44,6 +51,13 @@ func NewSubsonicDB(dbpath string) (sdb *SubsonicDB) {
     return
 }
 
+// serves browse requests from the catalog snapshot when one is loaded
+func (sdb *SubsonicDB) SetSnapshotStore(snapshots *SnapshotStore) {
+    sdb.snapshots = snapshots
+
+    return
+}
+
 // opens the sqlite database and prepares statements
 func (sdb *SubsonicDB) Open() (err error) {
     var db      *sql.DB
@@ -54,6 +68,7 @@ func (sdb *SubsonicDB) Open() (err error) {
     if err != nil {
         return
     }
+    sdb.db = db
 
     // prepare sql statements
     // getArtists
@@ -101,8 +116,7 @@ func (sdb *SubsonicDB) Open() (err error) {
     sdb.statements[GETSONGCNT] = stmt
 
     // get album art for artist
-    stmt, err = db.Prepare(`SELECT image FROM covers WHERE artistId=?
-                            AND image NOT NULL`)
+    stmt, err = db.Prepare(`SELECT image FROM covers WHERE albumId=(` + ARTISTCOVERALBUM + `)`)
     if err != nil {
         return
     }
@@ -155,9 +169,14 @@ func (sdb *SubsonicDB) Open() (err error) {
 
 // returns a list of indexed artists with per-artist album count
 func (sdb *SubsonicDB) GetIndexedArtists() (indexesptr *[]*SubsonicIndex, err error) {
-    var si      *SubsonicIndex
     var rows    *sql.Rows
-    var indexes = make([]*SubsonicIndex, 0)
+    var artists = make([]*SubsonicArtist, 0)
+
+    if sdb.snapshots != nil && sdb.snapshots.View(func(cs *CatalogSnapshot) {
+        indexesptr, err = cs.GetIndexedArtists()
+    }) {
+        return
+    }
 
     // run the prepared get artist statement
     rows, err = sdb.statements[GETARTISTS].Query(); if err != nil {
@@ -178,7 +197,7 @@ func (sdb *SubsonicDB) GetIndexedArtists() (indexesptr *[]*SubsonicIndex, err er
             continue
         }
 
-        // create an Artist object and add it to the index
+        // create an Artist object and add it to the list
         artist = &SubsonicArtist{
             Id:         id,
             Name:       name,
@@ -191,15 +210,28 @@ func (sdb *SubsonicDB) GetIndexedArtists() (indexesptr *[]*SubsonicIndex, err er
             return
         }
 
+        artists = append(artists, artist)
+    }
+
+    indexesptr  = indexArtists(artists)
+    return
+}
+
+// groups a list of artists sorted by name into per-initial indexes
+func indexArtists(artists []*SubsonicArtist) (indexesptr *[]*SubsonicIndex) {
+    var si      *SubsonicIndex
+    var indexes = make([]*SubsonicIndex, 0)
+
+    for _, artist := range artists {
         // make sure this artist belongs to the current index.
         // if not, add the old one to the list and create a new one
-        if si == nil || strings.ToUpper(name)[0] != si.Name[0] {
+        if si == nil || strings.ToUpper(artist.Name)[0] != si.Name[0] {
             if si != nil {
                 indexes = append(indexes, si)
             }
 
             si = &SubsonicIndex{
-                Name:       strings.ToUpper(string(name[0])),
+                Name:       strings.ToUpper(string(artist.Name[0])),
                 Artists:    make([]*SubsonicArtist, 0),
             }
         }
@@ -222,6 +254,12 @@ func (sdb *SubsonicDB) GetIndexes() (indexes *SubsonicIndexes, err error) {
     var lastUpdated uint64
     var idx         *[]*SubsonicIndex;
 
+    if sdb.snapshots != nil && sdb.snapshots.View(func(cs *CatalogSnapshot) {
+        indexes, err = cs.GetIndexes()
+    }) {
+        return
+    }
+
     // get the last update timestamp
     err = sdb.statements[GETMTIME].QueryRow("songs").Scan(&lastUpdated)
     if err != nil {
@@ -243,14 +281,23 @@ func (sdb *SubsonicDB) GetIndexes() (indexes *SubsonicIndexes, err error) {
     return
 }
 
-// returns a cover art image for the specified artist, album or song
-func (sdb *SubsonicDB) GetCoverArt(id string) (coverArt []byte, err error) {
+// returns a cover art image for the specified artist, album or song.
+// when size is non-zero, the smallest pre-scaled variant at least that large
+// is returned if the indexer generated one.
+func (sdb *SubsonicDB) GetCoverArt(id string, size int) (coverArt []byte, err error) {
     var rows    *sql.Rows
 
     if len(id) < 4 {
         return
     }
 
+    if size > 0 {
+        coverArt = sdb.getScaledCoverArt(id, size)
+        if len(coverArt) > 0 {
+            return
+        }
+    }
+
     switch id[0:3] {
         case "ar-":
             rows, err = sdb.statements[GETARTISTART].Query(id[3:]); if err != nil {
@@ -280,10 +327,45 @@ func (sdb *SubsonicDB) GetCoverArt(id string) (coverArt []byte, err error) {
     return
 }
 
+// returns a pre-scaled cover art image, if any. this never fails: databases
+// created by older indexers have no cover_variants table, in which case
+// callers fall back to the original image.
+func (sdb *SubsonicDB) getScaledCoverArt(id string, size int) (coverArt []byte) {
+    var err     error
+
+    switch id[0:3] {
+        case "ar-":
+            err = sdb.db.QueryRow(`SELECT image FROM cover_variants
+                                   WHERE albumId=(` + ARTISTCOVERALBUM + `)
+                                   AND size>=? AND image NOT NULL
+                                   ORDER BY size ASC LIMIT 1`,
+                                  id[3:], size).Scan(&coverArt)
+        case "al-":
+            err = sdb.db.QueryRow(`SELECT image FROM cover_variants
+                                   WHERE albumId=? AND size>=?
+                                   AND image NOT NULL
+                                   ORDER BY size ASC LIMIT 1`,
+                                  id[3:], size).Scan(&coverArt)
+    }
+
+    if err != nil {
+        coverArt = nil
+    }
+
+    return
+}
+
 // returns a list of all albums for a given artist id
 func (sdb *SubsonicDB) GetArtist(id string) (sr *SubsonicArtist, err error) {
     var rows    *sql.Rows
     var albums  = make([]*SubsonicAlbum, 0)
+
+    if sdb.snapshots != nil && sdb.snapshots.View(func(cs *CatalogSnapshot) {
+        sr, err = cs.GetArtist(id)
+    }) {
+        return
+    }
+
     sr = &SubsonicArtist{}
 
     // fetch the artist name and id
@@ -327,6 +409,12 @@ func (sdb *SubsonicDB) GetAlbum(id string) (sr *SubsonicAlbum, err error) {
     var rows    *sql.Rows
     var songs   = make([]*SubsonicSong, 0)
 
+    if sdb.snapshots != nil && sdb.snapshots.View(func(cs *CatalogSnapshot) {
+        sr, err = cs.GetAlbum(id)
+    }) {
+        return
+    }
+
     sr  = &SubsonicAlbum{
         CoverArt:   fmt.Sprintf("al-%v", id),
     }
@@ -367,6 +455,12 @@ func (sdb *SubsonicDB) GetAlbum(id string) (sr *SubsonicAlbum, err error) {
 func (sdb *SubsonicDB) GetSong(id string) (ss *SubsonicSong, err error) {
     var rows    *sql.Rows
 
+    if sdb.snapshots != nil && sdb.snapshots.View(func(cs *CatalogSnapshot) {
+        ss, err = cs.GetSong(id)
+    }) {
+        return
+    }
+
     // fetch the song
     rows, err = sdb.statements[GETSONG].Query(id)
     if err != nil {
@@ -411,7 +505,6 @@ func scanSong(row *sql.Rows) (s *SubsonicSong, err error) {
     var year        uint64
     var discn       uint64
     var filepath    string
-    var filesuffix  string
     s               = &SubsonicSong{}
 
     err = row.Scan(
@@ -423,6 +516,15 @@ func scanSong(row *sql.Rows) (s *SubsonicSong, err error) {
     // unused
     _   = discn
 
+    setSongPath(s, year, filepath)
+
+    return
+}
+
+// fills in the song fields derived from its year and file path
+func setSongPath(s *SubsonicSong, year uint64, filepath string) {
+    var filesuffix  string
+
     filesuffix  = strings.ToLower(path.Ext(filepath))
     if filesuffix != "" {
         // get rid of trailing slash
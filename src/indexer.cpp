@@ -9,6 +9,7 @@
 #include <algorithm>
 #include <map>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -17,8 +18,13 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <cstdint>
+#include <atomic>
+#include <csetjmp>
 
 #include <sqlite3.h>
+#include <jpeglib.h>
+#include <png.h>
 #include <taglib/fileref.h>
 #include <taglib/tag.h>
 #include <taglib/tpropertymap.h>
@@ -84,6 +90,17 @@ const char * init_sql = "\
     );\
 ";
 
+// tables added after the initial schema, created separately so that they
+// also show up in existing databases
+const char * upgrade_sql = "\
+    CREATE TABLE IF NOT EXISTS `cover_variants` (\
+        `albumId`   INTEGER NOT NULL,\
+        `size`      INTEGER NOT NULL,\
+        `image`     BLOB,\
+        PRIMARY KEY(albumId, size)\
+    );\
+";
+
 void panic_if(bool cond, string text) {
     if (cond) {
         cerr << text << endl;
@@ -528,6 +545,17 @@ void cleanup_db(sqlite3 * sqldb) {
     }
     sqlite3_finalize(stmt);
 
+    // remove scaled variants of orphaned album art
+    sqlite3_prepare_v2(sqldb,
+                        "DELETE FROM `cover_variants` WHERE ("
+                        "SELECT count(albumId) FROM `covers` WHERE albumId = cover_variants.albumId) = 0;",
+                        -1, &stmt, NULL);
+
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        cerr << "failed to cleanup cover variants: " << sqlite3_errmsg(sqldb) << endl;
+    }
+    sqlite3_finalize(stmt);
+
     return;
 }
 
@@ -562,6 +590,14 @@ void truncate_tables(sqlite3 * sqldb) {
     }
     sqlite3_finalize(stmt);
 
+    // truncate cover_variants table
+    sqlite3_prepare_v2(sqldb, "DELETE FROM `cover_variants`;", -1, &stmt, NULL);
+
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        cerr << "failed to truncate cover_variants table: " << sqlite3_errmsg(sqldb) << endl;
+    }
+    sqlite3_finalize(stmt);
+
     update_timestamp(sqldb, "albums");
 
     // truncate artists table
@@ -579,19 +615,811 @@ void truncate_tables(sqlite3 * sqldb) {
     return;
 }
 
+// pre-scaled cover art. each distinct cover is decoded once and shrunk to
+// fit within cover_variant_sizes (longest side), so that the server can
+// answer getCoverArt requests carrying a size parameter with a small jpeg
+// instead of the full-resolution original. covers already smaller than a
+// given size don't get that variant, the original is served instead.
+const int       cover_variant_sizes[]   = { 64, 256, 600 };
+const int       cover_variant_quality   = 85;
+// number of covers loaded in memory and resized in parallel at once
+const int       cover_batch_size        = 64;
+// upper bound on resizing threads, which bounds peak memory use at about
+// cover_max_workers x cover_max_pixels x 3 bytes on top of the batch itself
+const unsigned  cover_max_workers       = 4;
+// covers which would decode to more pixels than this (width x height) are
+// left alone, each worker holds a full RGB copy of the image it works on.
+// jpegs count at the reduced size libjpeg decodes them at, pngs at full size.
+const uint64_t  cover_max_pixels        = 6000 * 6000;
+
+struct cover_image {
+    int             width;
+    int             height;
+    vector<uint8_t> rgb;
+};
+
+struct cover_job {
+    uint64_t                albumId;
+    uint64_t                hash;
+    string                  image;
+    // (size, jpeg data) pairs, filled in by the workers
+    vector<pair<int, string>> variants;
+};
+
+// libjpeg calls exit() on errors by default, jump back to the caller instead
+struct jpeg_error_jmp {
+    struct jpeg_error_mgr   mgr;
+    jmp_buf                 jmp;
+};
+
+void jpeg_error_longjmp(j_common_ptr cinfo) {
+    longjmp(((jpeg_error_jmp *) cinfo->err)->jmp, 1);
+}
+
+void jpeg_error_silent(j_common_ptr cinfo) {
+    (void) cinfo;
+}
+
+bool decode_jpeg(const string & data, int max_size, cover_image & img) {
+    struct jpeg_decompress_struct   cinfo;
+    jpeg_error_jmp                  jerr;
+
+    cinfo.err                   = jpeg_std_error(&jerr.mgr);
+    jerr.mgr.error_exit         = jpeg_error_longjmp;
+    jerr.mgr.output_message     = jpeg_error_silent;
+    if (setjmp(jerr.jmp)) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char *) data.data(), data.size());
+    jpeg_read_header(&cinfo, TRUE);
+
+    // let libjpeg skip most of the work when the image is much bigger than
+    // our largest variant
+    cinfo.out_color_space       = JCS_RGB;
+    cinfo.scale_num             = 1;
+    cinfo.scale_denom           = 1;
+    while (cinfo.scale_denom < 8 &&
+           (int) min(cinfo.image_width, cinfo.image_height) / (int) (cinfo.scale_denom * 2) >= max_size) {
+        cinfo.scale_denom *= 2;
+    }
+
+    jpeg_calc_output_dimensions(&cinfo);
+    if ((uint64_t) cinfo.output_width * cinfo.output_height > cover_max_pixels) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+
+    jpeg_start_decompress(&cinfo);
+
+    img.width   = cinfo.output_width;
+    img.height  = cinfo.output_height;
+    try {
+        img.rgb.resize((size_t) img.width * img.height * 3);
+    } catch (...) {
+        jpeg_destroy_decompress(&cinfo);
+        throw;
+    }
+
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = &img.rgb[(size_t) cinfo.output_scanline * img.width * 3];
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+
+    return true;
+}
+
+bool decode_png(const string & data, cover_image & img) {
+    png_image   png;
+
+    memset(&png, 0, sizeof(png));
+    png.version = PNG_IMAGE_VERSION;
+
+    if (!png_image_begin_read_from_memory(&png, data.data(), data.size())) {
+        return false;
+    }
+
+    if ((uint64_t) png.width * png.height > cover_max_pixels) {
+        png_image_free(&png);
+        return false;
+    }
+
+    png.format  = PNG_FORMAT_RGB;
+    img.width   = png.width;
+    img.height  = png.height;
+    try {
+        img.rgb.resize(PNG_IMAGE_SIZE(png));
+    } catch (...) {
+        png_image_free(&png);
+        throw;
+    }
+
+    if (!png_image_finish_read(&png, NULL, img.rgb.data(), 0, NULL)) {
+        png_image_free(&png);
+        return false;
+    }
+
+    return true;
+}
+
+bool encode_jpeg(const cover_image & img, string & out) {
+    struct jpeg_compress_struct cinfo;
+    jpeg_error_jmp              jerr;
+    unsigned char               *buf    = NULL;
+    unsigned long               size    = 0;
+
+    cinfo.err                   = jpeg_std_error(&jerr.mgr);
+    jerr.mgr.error_exit         = jpeg_error_longjmp;
+    jerr.mgr.output_message     = jpeg_error_silent;
+    if (setjmp(jerr.jmp)) {
+        jpeg_destroy_compress(&cinfo);
+        free(buf);
+        return false;
+    }
+
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &buf, &size);
+
+    cinfo.image_width       = img.width;
+    cinfo.image_height      = img.height;
+    cinfo.input_components  = 3;
+    cinfo.in_color_space    = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, cover_variant_quality, TRUE);
+
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = (JSAMPROW) &img.rgb[(size_t) cinfo.next_scanline * img.width * 3];
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+
+    out.assign((const char *) buf, size);
+    jpeg_destroy_compress(&cinfo);
+    free(buf);
+
+    return true;
+}
+
+// shrinks src so that its longest side is size pixels, averaging all source
+// pixels covered by each destination pixel
+cover_image scale_image(const cover_image & src, int size) {
+    cover_image dst;
+
+    if (src.width >= src.height) {
+        dst.width   = size;
+        dst.height  = max(1, (int) ((int64_t) src.height * size / src.width));
+    } else {
+        dst.height  = size;
+        dst.width   = max(1, (int) ((int64_t) src.width * size / src.height));
+    }
+    dst.rgb.resize((size_t) dst.width * dst.height * 3);
+
+    for (int y = 0; y < dst.height; y++) {
+        int y0 = (int64_t) y * src.height / dst.height;
+        int y1 = max(y0 + 1, (int) ((int64_t) (y + 1) * src.height / dst.height));
+
+        for (int x = 0; x < dst.width; x++) {
+            int         x0      = (int64_t) x * src.width / dst.width;
+            int         x1      = max(x0 + 1, (int) ((int64_t) (x + 1) * src.width / dst.width));
+            uint32_t    sum[3]  = { 0, 0, 0 };
+
+            for (int sy = y0; sy < y1; sy++) {
+                const uint8_t * p = &src.rgb[((size_t) sy * src.width + x0) * 3];
+                for (int sx = x0; sx < x1; sx++, p += 3) {
+                    sum[0] += p[0];
+                    sum[1] += p[1];
+                    sum[2] += p[2];
+                }
+            }
+
+            uint32_t    n       = (y1 - y0) * (x1 - x0);
+            uint8_t     *d      = &dst.rgb[((size_t) y * dst.width + x) * 3];
+            d[0] = (sum[0] + n / 2) / n;
+            d[1] = (sum[1] + n / 2) / n;
+            d[2] = (sum[2] + n / 2) / n;
+        }
+    }
+
+    return dst;
+}
+
+// decodes a cover and builds all variants smaller than the original.
+// undecodable covers simply end up without variants.
+void build_cover_variants(cover_job & job) {
+    const string &  data    = job.image;
+    int             largest = 0;
+    cover_image     img;
+    bool            ok      = false;
+
+    for (int size: cover_variant_sizes) {
+        largest = max(largest, size);
+    }
+
+    if (data.size() > 3 && (uint8_t) data[0] == 0xFF && (uint8_t) data[1] == 0xD8) {
+        ok = decode_jpeg(data, largest, img);
+    } else if (data.size() > 8 && memcmp(data.data(), "\x89PNG\r\n\x1a\n", 8) == 0) {
+        ok = decode_png(data, img);
+    }
+
+    if (!ok || img.width <= 0 || img.height <= 0) {
+        return;
+    }
+
+    for (int size: cover_variant_sizes) {
+        string out;
+
+        if (max(img.width, img.height) <= size) {
+            continue;
+        }
+
+        if (encode_jpeg(scale_image(img, size), out)) {
+            job.variants.push_back(make_pair(size, out));
+        }
+    }
+
+    return;
+}
+
+// runs on worker threads, where an uncaught exception would take the whole
+// indexer down: a cover we fail to process only gets its size 0 marker.
+void make_cover_variants(cover_job & job) {
+    try {
+        build_cover_variants(job);
+    } catch (const exception & e) {
+        cerr << "failed to scale cover of album " << job.albumId << ": " << e.what() << endl;
+        job.variants.clear();
+    }
+
+    return;
+}
+
+void insert_cover_variant(sqlite3 * sqldb, uint64_t albumId, int size, const string & image) {
+    sqlite3_stmt *stmt;
+    sqlite3_prepare_v2(sqldb,
+        "INSERT OR REPLACE INTO `cover_variants` (`albumId`, `size`, `image`) "
+        "VALUES (?,?,?);", -1, &stmt, NULL);
+
+    sqlite3_bind_int64(stmt, 1, albumId);
+    sqlite3_bind_int  (stmt, 2, size);
+    if (size > 0) {
+        sqlite3_bind_blob(stmt, 3, image.data(), image.size(), NULL);
+    } else {
+        sqlite3_bind_null(stmt, 3);
+    }
+
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        cerr << "failed to insert cover variant: " << sqlite3_errmsg(sqldb) << endl;
+    }
+
+    sqlite3_finalize(stmt);
+
+    return;
+}
+
+// copies the variants of an already processed cover to another album
+void copy_cover_variants(sqlite3 * sqldb, uint64_t from, uint64_t to) {
+    sqlite3_stmt *stmt;
+    sqlite3_prepare_v2(sqldb,
+        "INSERT OR REPLACE INTO `cover_variants` (`albumId`, `size`, `image`) "
+        "SELECT ?, `size`, `image` FROM `cover_variants` WHERE `albumId` = ?;",
+        -1, &stmt, NULL);
+
+    sqlite3_bind_int64(stmt, 1, to);
+    sqlite3_bind_int64(stmt, 2, from);
+
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        cerr << "failed to copy cover variants: " << sqlite3_errmsg(sqldb) << endl;
+    }
+
+    sqlite3_finalize(stmt);
+
+    return;
+}
+
+// generates variants for all covers which don't have any yet. images are
+// decoded and resized by a pool of worker threads, a batch at a time, while
+// the database is only ever touched from the calling thread.
+int scale_covers(sqlite3 * sqldb) {
+    map<uint64_t, uint64_t> done;
+    unsigned                nworkers    = min(cover_max_workers, max(1u, thread::hardware_concurrency()));
+    int                     processed   = 0;
+
+    while (true) {
+        sqlite3_stmt        *stmt;
+        vector<cover_job>   jobs;
+        vector<cover_job*>  pending;
+        vector<thread>      workers;
+        atomic<size_t>      next(0);
+        int                 progress    = 0;
+
+        sqlite3_prepare_v2(sqldb,
+            "SELECT `albumId`, `image` FROM `covers` WHERE `image` NOT NULL "
+            "AND `albumId` NOT IN (SELECT `albumId` FROM `cover_variants`) LIMIT ?;",
+            -1, &stmt, NULL);
+        sqlite3_bind_int(stmt, 1, cover_batch_size);
+
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            cover_job job;
+
+            job.albumId = sqlite3_column_int64(stmt, 0);
+            job.image.assign((const char *) sqlite3_column_blob(stmt, 1), sqlite3_column_bytes(stmt, 1));
+            job.hash    = calcId(job.image);
+            jobs.push_back(job);
+        }
+        sqlite3_finalize(stmt);
+
+        if (jobs.empty()) {
+            break;
+        }
+
+        // only decode each distinct image once
+        map<uint64_t, cover_job*> seen;
+        for (auto & job: jobs) {
+            if (done.count(job.hash) == 0 && seen.count(job.hash) == 0) {
+                seen[job.hash] = &job;
+                pending.push_back(&job);
+            }
+        }
+
+        for (unsigned i = 0; i < min<size_t>(nworkers, pending.size()); i++) {
+            workers.push_back(thread([&]() {
+                size_t n;
+                while ((n = next++) < pending.size()) {
+                    make_cover_variants(*pending[n]);
+                }
+            }));
+        }
+        for (auto & worker: workers) {
+            worker.join();
+        }
+
+        sqlite3_exec(sqldb, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+
+        for (auto & job: jobs) {
+            if (done.count(job.hash)) {
+                copy_cover_variants(sqldb, done[job.hash], job.albumId);
+            } else {
+                for (auto & variant: job.variants) {
+                    insert_cover_variant(sqldb, job.albumId, variant.first, variant.second);
+                }
+                // size 0 marks the cover as processed, even if it got no variants
+                insert_cover_variant(sqldb, job.albumId, 0, "");
+                done[job.hash] = job.albumId;
+            }
+
+            if (sqlite3_changes(sqldb) != 0) {
+                progress++;
+            }
+        }
+
+        sqlite3_exec(sqldb, "COMMIT;", NULL, NULL, NULL);
+
+        processed += progress;
+
+        // bail out rather than spin on covers we can't write
+        if (progress == 0) {
+            break;
+        }
+    }
+
+    return processed;
+}
+
+// catalog snapshot, see src/snapshot.go for the reader side.
+// the snapshot is a read-only copy of the artists, albums and songs tables
+// laid out so that the server can mmap it and browse the catalog without
+// touching sqlite. all integers are little-endian and all sections start on
+// an 8-byte boundary:
+//   header       (snapshot_header_size bytes)
+//   artists      artist_count x 24 bytes, ordered by name (nocase)
+//   albums       album_count  x 48 bytes, grouped by artist, ordered by title
+//   songs        song_count   x 96 bytes, grouped by album, ordered by disc/track
+//   artist ids   artist_count x 16 bytes (id, record index), ordered by id
+//   album ids    album_count  x 16 bytes
+//   song ids     song_count   x 16 bytes
+//   strings      string pool, referenced by (offset, length) pairs
+const char *    snapshot_magic          = "UBERSNAP";
+const uint32_t  snapshot_version        = 1;
+const uint32_t  snapshot_header_size    = 104;
+
+struct snapshot_artist {
+    uint64_t    id;
+    string      name;
+    uint32_t    first_album;
+    uint32_t    album_count;
+};
+
+struct snapshot_album {
+    uint64_t    id;
+    uint64_t    artistid;
+    string      title;
+    string      artist;
+    uint32_t    artist_idx;
+    uint32_t    first_song;
+    uint32_t    song_count;
+    uint32_t    duration;
+};
+
+struct snapshot_song {
+    uint64_t    id;
+    uint64_t    albumid;
+    uint64_t    artistid;
+    string      title;
+    string      album;
+    string      artist;
+    string      genre;
+    string      type;
+    string      filename;
+    uint32_t    trackn;
+    uint32_t    discn;
+    uint32_t    year;
+    uint32_t    duration;
+    uint32_t    bitrate;
+    uint32_t    album_idx;
+};
+
+// records which do not belong to any parent (e.g. albums of an artist
+// which went away) sort last and are only reachable through their id
+const uint32_t  snapshot_no_parent      = 0xFFFFFFFF;
+
+string column_string(sqlite3_stmt * stmt, int col) {
+    const unsigned char * text = sqlite3_column_text(stmt, col);
+
+    return text ? string((const char *) text) : string();
+}
+
+void put_u32(string & buf, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        buf.push_back((char) ((v >> (8 * i)) & 0xFF));
+    }
+}
+
+void put_u64(string & buf, uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+        buf.push_back((char) ((v >> (8 * i)) & 0xFF));
+    }
+}
+
+void put_align(string & buf) {
+    while (buf.size() % 8) {
+        buf.push_back(0);
+    }
+}
+
+// appends a string to the pool (once) and writes its (offset, length) ref
+void put_string(string & buf, string & pool, map<string, uint32_t> & seen, const string & s) {
+    auto it = seen.find(s);
+    uint32_t off;
+
+    if (it != seen.end()) {
+        off = it->second;
+    } else {
+        off = pool.size();
+        pool.append(s);
+        seen[s] = off;
+    }
+
+    put_u32(buf, off);
+    put_u32(buf, s.size());
+}
+
+void put_id_index(string & buf, vector<pair<uint64_t, uint32_t>> ids) {
+    sort(ids.begin(), ids.end());
+
+    for (auto & id: ids) {
+        put_u64(buf, id.first);
+        put_u32(buf, id.second);
+        put_u32(buf, 0);
+    }
+}
+
+// reports a failed catalog read and abandons the snapshot
+bool snapshot_read_error(sqlite3 * sqldb, sqlite3_stmt * stmt) {
+    cerr << "failed to read catalog for snapshot: " << sqlite3_errmsg(sqldb) << endl;
+
+    sqlite3_finalize(stmt);
+    sqlite3_exec(sqldb, "ROLLBACK;", NULL, NULL, NULL);
+
+    return false;
+}
+
+// dumps the catalog into a snapshot file next to the database. the file is
+// written under a temporary name and renamed into place so that the server
+// never sees a partial snapshot.
+bool write_snapshot(sqlite3 * sqldb, string path) {
+    sqlite3_stmt                    *stmt;
+    int                             rc;
+    vector<snapshot_artist>         artists;
+    vector<snapshot_album>          albums;
+    vector<snapshot_song>           songs;
+    map<uint64_t, uint32_t>         artist_idx;
+    map<uint64_t, uint32_t>         album_idx;
+    uint64_t                        songs_mtime = 0;
+
+    // read everything within a single transaction to get a consistent view.
+    // any failure leaves the previous snapshot in place: a partial one would
+    // look perfectly valid to the server.
+    if (sqlite3_exec(sqldb, "BEGIN TRANSACTION;", NULL, NULL, NULL) != SQLITE_OK) {
+        return snapshot_read_error(sqldb, NULL);
+    }
+
+    if (sqlite3_prepare_v2(sqldb,
+        "SELECT `mtime` FROM `last_update_ts` WHERE `table_name` = 'songs';",
+        -1, &stmt, NULL) != SQLITE_OK) {
+        return snapshot_read_error(sqldb, NULL);
+    }
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+        songs_mtime = sqlite3_column_int64(stmt, 0);
+    } else if (rc != SQLITE_DONE) {
+        return snapshot_read_error(sqldb, stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    if (sqlite3_prepare_v2(sqldb,
+        "SELECT `id`, `name` FROM `artists` ORDER BY `name` COLLATE NOCASE ASC;",
+        -1, &stmt, NULL) != SQLITE_OK) {
+        return snapshot_read_error(sqldb, NULL);
+    }
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        snapshot_artist ar;
+
+        ar.id           = sqlite3_column_int64(stmt, 0);
+        ar.name         = column_string(stmt, 1);
+        ar.first_album  = 0;
+        ar.album_count  = 0;
+
+        artist_idx[ar.id] = artists.size();
+        artists.push_back(ar);
+    }
+    if (rc != SQLITE_DONE) {
+        return snapshot_read_error(sqldb, stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    if (sqlite3_prepare_v2(sqldb,
+        "SELECT `id`, `title`, `artistid`, `artist` FROM `albums` "
+        "ORDER BY `title` COLLATE NOCASE ASC;",
+        -1, &stmt, NULL) != SQLITE_OK) {
+        return snapshot_read_error(sqldb, NULL);
+    }
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        snapshot_album al;
+
+        al.id           = sqlite3_column_int64(stmt, 0);
+        al.title        = column_string(stmt, 1);
+        al.artistid     = sqlite3_column_int64(stmt, 2);
+        al.artist       = column_string(stmt, 3);
+        al.first_song   = 0;
+        al.song_count   = 0;
+        al.duration     = 0;
+
+        auto it = artist_idx.find(al.artistid);
+        al.artist_idx   = (it != artist_idx.end()) ? it->second : snapshot_no_parent;
+
+        albums.push_back(al);
+    }
+    if (rc != SQLITE_DONE) {
+        return snapshot_read_error(sqldb, stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    if (sqlite3_prepare_v2(sqldb,
+        "SELECT `id`, `title`, `albumid`, `album`, `artistid`, `artist`, "
+        "`trackn`, `discn`, `year`, `duration`, `bitRate`, `genre`, `type`, `filename` "
+        "FROM `songs` ORDER BY `discn` ASC, `trackn` ASC, `title` COLLATE NOCASE ASC;",
+        -1, &stmt, NULL) != SQLITE_OK) {
+        return snapshot_read_error(sqldb, NULL);
+    }
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        snapshot_song s;
+
+        s.id            = sqlite3_column_int64(stmt, 0);
+        s.title         = column_string(stmt, 1);
+        s.albumid       = sqlite3_column_int64(stmt, 2);
+        s.album         = column_string(stmt, 3);
+        s.artistid      = sqlite3_column_int64(stmt, 4);
+        s.artist        = column_string(stmt, 5);
+        s.trackn        = sqlite3_column_int(stmt, 6);
+        s.discn         = sqlite3_column_int(stmt, 7);
+        s.year          = sqlite3_column_int(stmt, 8);
+        s.duration      = sqlite3_column_int(stmt, 9);
+        s.bitrate       = sqlite3_column_int(stmt, 10);
+        s.genre         = column_string(stmt, 11);
+        s.type          = column_string(stmt, 12);
+        s.filename      = column_string(stmt, 13);
+
+        songs.push_back(s);
+    }
+    if (rc != SQLITE_DONE) {
+        return snapshot_read_error(sqldb, stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    if (sqlite3_exec(sqldb, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) {
+        return snapshot_read_error(sqldb, NULL);
+    }
+
+    // group albums by artist and record each artist's album range
+    stable_sort(albums.begin(), albums.end(),
+        [](const snapshot_album & a, const snapshot_album & b) {
+            return a.artist_idx < b.artist_idx;
+        });
+
+    for (uint32_t i = 0; i < albums.size(); i++) {
+        album_idx[albums[i].id] = i;
+
+        if (albums[i].artist_idx == snapshot_no_parent) {
+            continue;
+        }
+
+        snapshot_artist & ar = artists[albums[i].artist_idx];
+        if (ar.album_count == 0) {
+            ar.first_album = i;
+        }
+        ar.album_count++;
+    }
+
+    // group songs by album and record each album's song range and duration
+    for (auto & s: songs) {
+        auto it = album_idx.find(s.albumid);
+        s.album_idx     = (it != album_idx.end()) ? it->second : snapshot_no_parent;
+    }
+
+    stable_sort(songs.begin(), songs.end(),
+        [](const snapshot_song & a, const snapshot_song & b) {
+            return a.album_idx < b.album_idx;
+        });
+
+    for (uint32_t i = 0; i < songs.size(); i++) {
+        if (songs[i].album_idx == snapshot_no_parent) {
+            continue;
+        }
+
+        snapshot_album & al = albums[songs[i].album_idx];
+        if (al.song_count == 0) {
+            al.first_song = i;
+        }
+        al.song_count++;
+        al.duration     += songs[i].duration;
+    }
+
+    // serialize all sections, leaving room for the header
+    string                              buf(snapshot_header_size, '\0');
+    string                              pool;
+    map<string, uint32_t>               seen;
+    vector<pair<uint64_t, uint32_t>>    ids;
+    uint64_t                            artists_off, albums_off, songs_off;
+    uint64_t                            artist_ids_off, album_ids_off, song_ids_off;
+    uint64_t                            strings_off;
+
+    artists_off = buf.size();
+    for (auto & ar: artists) {
+        put_u64(buf, ar.id);
+        put_string(buf, pool, seen, ar.name);
+        put_u32(buf, ar.first_album);
+        put_u32(buf, ar.album_count);
+    }
+
+    albums_off = buf.size();
+    for (auto & al: albums) {
+        put_u64(buf, al.id);
+        put_u64(buf, al.artistid);
+        put_string(buf, pool, seen, al.title);
+        put_string(buf, pool, seen, al.artist);
+        put_u32(buf, al.first_song);
+        put_u32(buf, al.song_count);
+        put_u32(buf, al.duration);
+        put_u32(buf, 0);
+    }
+
+    songs_off = buf.size();
+    for (auto & s: songs) {
+        put_u64(buf, s.id);
+        put_u64(buf, s.albumid);
+        put_u64(buf, s.artistid);
+        put_string(buf, pool, seen, s.title);
+        put_string(buf, pool, seen, s.album);
+        put_string(buf, pool, seen, s.artist);
+        put_string(buf, pool, seen, s.genre);
+        put_string(buf, pool, seen, s.type);
+        put_string(buf, pool, seen, s.filename);
+        put_u32(buf, s.trackn);
+        put_u32(buf, s.discn);
+        put_u32(buf, s.year);
+        put_u32(buf, s.duration);
+        put_u32(buf, s.bitrate);
+        put_u32(buf, 0);
+    }
+
+    artist_ids_off = buf.size();
+    ids.clear();
+    for (uint32_t i = 0; i < artists.size(); i++) {
+        ids.push_back(make_pair(artists[i].id, i));
+    }
+    put_id_index(buf, ids);
+
+    album_ids_off = buf.size();
+    ids.clear();
+    for (uint32_t i = 0; i < albums.size(); i++) {
+        ids.push_back(make_pair(albums[i].id, i));
+    }
+    put_id_index(buf, ids);
+
+    song_ids_off = buf.size();
+    ids.clear();
+    for (uint32_t i = 0; i < songs.size(); i++) {
+        ids.push_back(make_pair(songs[i].id, i));
+    }
+    put_id_index(buf, ids);
+
+    strings_off = buf.size();
+    buf.append(pool);
+    put_align(buf);
+
+    // now that all offsets are known, fill in the header
+    string header(snapshot_magic, 8);
+    put_u32(header, snapshot_version);
+    put_u32(header, snapshot_header_size);
+    put_u64(header, songs_mtime);
+    put_u32(header, artists.size());
+    put_u32(header, albums.size());
+    put_u32(header, songs.size());
+    put_u32(header, pool.size());
+    put_u64(header, artists_off);
+    put_u64(header, albums_off);
+    put_u64(header, songs_off);
+    put_u64(header, artist_ids_off);
+    put_u64(header, album_ids_off);
+    put_u64(header, song_ids_off);
+    put_u64(header, strings_off);
+    put_u64(header, buf.size());
+    buf.replace(0, header.size(), header);
+
+    // write to a temp file, then atomically swap it in
+    string  tmppath = path + ".tmp";
+    FILE    *f      = fopen(tmppath.c_str(), "wb");
+    if (!f) {
+        cerr << "failed to create snapshot " << tmppath << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    bool ok = fwrite(buf.data(), 1, buf.size(), f) == buf.size();
+    ok      = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok      = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmppath.c_str(), path.c_str()) != 0) {
+        cerr << "failed to write snapshot " << path << ": " << strerror(errno) << endl;
+        unlink(tmppath.c_str());
+        return false;
+    }
+
+    cout << "wrote snapshot of " << artists.size() << " artists, " << albums.size()
+         << " albums and " << songs.size() << " songs to " << path << endl;
+
+    return true;
+}
+
 void usage(char* argv[]) {
     fprintf(stderr,
         "Usage: %s action [args...]\n"
         "  %s scan file.db musicdir                 : scan musicdir for new songs\n"
         "  %s fullscan file.db musicdir             : delete all records and do a full rescan\n"
+        "  %s snapshot file.db                      : rewrite the catalog snapshot\n"
         "  %s useradd file.db username password     : add user\n"
         "  %s userdel file.db username              : delete user\n",
-        argv[0],argv[0],argv[0],argv[0], argv[0]);
+        argv[0],argv[0],argv[0],argv[0],argv[0], argv[0]);
 }
 
 int main(int argc, char* argv[]) {
     sqlite3*    sqldb;
     int         ok;
+    int         ret = 0;
 
     if (argc < 3) {
         usage(argv);
@@ -618,6 +1446,7 @@ int main(int argc, char* argv[]) {
 
     // make sure the schema exists
     sqlite3_exec(sqldb, init_sql, NULL, NULL, NULL);
+    sqlite3_exec(sqldb, upgrade_sql, NULL, NULL, NULL);
 
     if (action == "scan") {
         string  musicdir    = argv[3];
@@ -632,6 +1461,16 @@ int main(int argc, char* argv[]) {
         cout << "cleaning up database..." << endl;
         cleanup_db(sqldb);
 
+        // build scaled down versions of new covers
+        cout << "scaling cover art..." << endl;
+        cout << "scaled " << scale_covers(sqldb) << " covers" << endl;
+
+        // publish the new catalog to the server
+        if (!write_snapshot(sqldb, dbpath + ".snapshot")) {
+            cerr << "snapshot not updated, the server keeps serving the previous one" << endl;
+            ret = 1;
+        }
+
     } else if (action == "fullscan") {
         string musicdir     = argv[3];
         int    added        = 0;
@@ -645,6 +1484,21 @@ int main(int argc, char* argv[]) {
         added   = scan_fs(sqldb, musicdir);
         cout << "added " << added << " files" << endl;
 
+        // build scaled down versions of all covers
+        cout << "scaling cover art..." << endl;
+        cout << "scaled " << scale_covers(sqldb) << " covers" << endl;
+
+        // publish the new catalog to the server
+        if (!write_snapshot(sqldb, dbpath + ".snapshot")) {
+            cerr << "snapshot not updated, the server keeps serving the previous one" << endl;
+            ret = 1;
+        }
+
+    } else if (action == "snapshot") {
+        if (!write_snapshot(sqldb, dbpath + ".snapshot")) {
+            ret = 1;
+        }
+
     } else if (action == "useradd") {
         string user = argv[3];
         string pass = argv[4];
@@ -683,5 +1537,5 @@ int main(int argc, char* argv[]) {
     // Close and write to disk
     sqlite3_close(sqldb);
 
-    return 0;
+    return ret;
 }
@@ -4,11 +4,13 @@ import (
     "log"
     "os"
     "flag"
+    "time"
 )
 
 func main() {
     var logger      *log.Logger = log.New(os.Stdout, "", log.LstdFlags)
     var sdb         *SubsonicDB
+    var snapshots   *SnapshotStore
     var err         error
     var server      *ApiServer
     var port        int
@@ -49,6 +51,12 @@ func main() {
         logger.Fatal("failed to open database:", err)
     }
 
+    // serve browse requests from the catalog snapshot published by the
+    // indexer, picking up new snapshots as they appear
+    snapshots = NewSnapshotStore(logger, dbPath + ".snapshot")
+    snapshots.Watch(10 * time.Second)
+    sdb.SetSnapshotStore(snapshots)
+
     server = NewServer(logger, sdb, port, cert, key)
 
     logger.Printf("starting server on port %v", port)
@@ -0,0 +1,423 @@
+package main
+
+import (
+    "encoding/binary"
+    "errors"
+    "fmt"
+    "log"
+    "os"
+    "sort"
+    "strconv"
+    "sync"
+    "syscall"
+    "time"
+)
+
+// catalog snapshot layout, written by write_snapshot() in indexer.cpp.
+// all integers are little-endian.
+const (
+    SNAPSHOT_MAGIC          = "UBERSNAP"
+    SNAPSHOT_VERSION        = 1
+    SNAPSHOT_HEADER_SIZE    = 104
+    SNAPSHOT_ARTIST_SIZE    = 24
+    SNAPSHOT_ALBUM_SIZE     = 48
+    SNAPSHOT_SONG_SIZE      = 96
+    SNAPSHOT_ID_SIZE        = 16
+    // parent index of records which don't belong to any artist/album
+    SNAPSHOT_NO_PARENT      = 0xFFFFFFFF
+)
+
+var ErrBadSnapshot = errors.New("invalid catalog snapshot")
+
+var le = binary.LittleEndian
+
+// read-only, memory-mapped view of the catalog
+type CatalogSnapshot struct {
+    data            []byte
+    songsMtime      uint64
+    artistCount     uint32
+    albumCount      uint32
+    songCount       uint32
+    artistsOff      uint64
+    albumsOff       uint64
+    songsOff        uint64
+    artistIdsOff    uint64
+    albumIdsOff     uint64
+    songIdsOff      uint64
+    stringsOff      uint64
+    stringsSize     uint64
+}
+
+// maps a snapshot file and validates its header
+func OpenCatalogSnapshot(path string) (cs *CatalogSnapshot, err error) {
+    var file    *os.File
+    var finfo   os.FileInfo
+    var data    []byte
+
+    file, err = os.Open(path); if err != nil {
+        return
+    }
+    defer file.Close()
+
+    finfo, err = file.Stat(); if err != nil {
+        return
+    }
+
+    if finfo.Size() < SNAPSHOT_HEADER_SIZE {
+        err = ErrBadSnapshot
+        return
+    }
+
+    data, err = syscall.Mmap(int(file.Fd()), 0, int(finfo.Size()),
+                             syscall.PROT_READ, syscall.MAP_SHARED)
+    if err != nil {
+        return
+    }
+
+    cs = &CatalogSnapshot{
+        data:           data,
+        songsMtime:     le.Uint64(data[16:]),
+        artistCount:    le.Uint32(data[24:]),
+        albumCount:     le.Uint32(data[28:]),
+        songCount:      le.Uint32(data[32:]),
+        stringsSize:    uint64(le.Uint32(data[36:])),
+        artistsOff:     le.Uint64(data[40:]),
+        albumsOff:      le.Uint64(data[48:]),
+        songsOff:       le.Uint64(data[56:]),
+        artistIdsOff:   le.Uint64(data[64:]),
+        albumIdsOff:    le.Uint64(data[72:]),
+        songIdsOff:     le.Uint64(data[80:]),
+        stringsOff:     le.Uint64(data[88:]),
+    }
+
+    err = cs.validate(); if err != nil {
+        cs.Close()
+        cs = nil
+    }
+
+    return
+}
+
+// makes sure every section lies within the mapping so that accessors don't
+// have to bounds-check record offsets
+func (cs *CatalogSnapshot) validate() (err error) {
+    var size    = uint64(len(cs.data))
+    var inside  = func(off uint64, count uint32, recSize uint64) bool {
+        return off <= size && uint64(count) * recSize <= size - off
+    }
+
+    if string(cs.data[0:8]) != SNAPSHOT_MAGIC ||
+       le.Uint32(cs.data[8:]) != SNAPSHOT_VERSION ||
+       le.Uint32(cs.data[12:]) != SNAPSHOT_HEADER_SIZE ||
+       le.Uint64(cs.data[96:]) != size {
+        return ErrBadSnapshot
+    }
+
+    if !inside(cs.artistsOff, cs.artistCount, SNAPSHOT_ARTIST_SIZE) ||
+       !inside(cs.albumsOff, cs.albumCount, SNAPSHOT_ALBUM_SIZE) ||
+       !inside(cs.songsOff, cs.songCount, SNAPSHOT_SONG_SIZE) ||
+       !inside(cs.artistIdsOff, cs.artistCount, SNAPSHOT_ID_SIZE) ||
+       !inside(cs.albumIdsOff, cs.albumCount, SNAPSHOT_ID_SIZE) ||
+       !inside(cs.songIdsOff, cs.songCount, SNAPSHOT_ID_SIZE) ||
+       !inside(cs.stringsOff, 1, cs.stringsSize) {
+        return ErrBadSnapshot
+    }
+
+    return
+}
+
+// unmaps the snapshot. no accessor may be called afterwards.
+func (cs *CatalogSnapshot) Close() (err error) {
+    err     = syscall.Munmap(cs.data)
+    cs.data = nil
+
+    return
+}
+
+// returns the string referenced by the (offset, length) pair at off
+func (cs *CatalogSnapshot) str(off uint64) string {
+    var soff = uint64(le.Uint32(cs.data[off:]))
+    var slen = uint64(le.Uint32(cs.data[off + 4:]))
+
+    if soff + slen > cs.stringsSize {
+        return ""
+    }
+
+    return string(cs.data[cs.stringsOff + soff:cs.stringsOff + soff + slen])
+}
+
+// binary searches an id index, returns the matching record index
+func (cs *CatalogSnapshot) lookup(idsOff uint64, count uint32, id string) (idx uint32, ok bool) {
+    var nid     uint64
+    var err     error
+    var i       int
+
+    nid, err = strconv.ParseUint(id, 10, 64); if err != nil {
+        return
+    }
+
+    i = sort.Search(int(count), func(i int) bool {
+        return le.Uint64(cs.data[idsOff + uint64(i) * SNAPSHOT_ID_SIZE:]) >= nid
+    })
+
+    if i < int(count) && le.Uint64(cs.data[idsOff + uint64(i) * SNAPSHOT_ID_SIZE:]) == nid {
+        idx = le.Uint32(cs.data[idsOff + uint64(i) * SNAPSHOT_ID_SIZE + 8:])
+        ok  = idx < count
+    }
+
+    return
+}
+
+// returns a list of indexed artists with per-artist album count
+func (cs *CatalogSnapshot) GetIndexedArtists() (indexesptr *[]*SubsonicIndex, err error) {
+    var artists = make([]*SubsonicArtist, 0, cs.artistCount)
+
+    for i := uint32(0); i < cs.artistCount; i++ {
+        var off = cs.artistsOff + uint64(i) * SNAPSHOT_ARTIST_SIZE
+        var name = cs.str(off + 8)
+
+        if name == "" {
+            continue
+        }
+
+        artists = append(artists, &SubsonicArtist{
+            Id:         le.Uint64(cs.data[off:]),
+            Name:       name,
+            CoverArt:   fmt.Sprintf("ar-%v", le.Uint64(cs.data[off:])),
+            AlbumCount: uint64(le.Uint32(cs.data[off + 20:])),
+        })
+    }
+
+    indexesptr = indexArtists(artists)
+    return
+}
+
+// returns a populated SubsonicIndexes object
+func (cs *CatalogSnapshot) GetIndexes() (indexes *SubsonicIndexes, err error) {
+    var idx *[]*SubsonicIndex
+
+    idx, err = cs.GetIndexedArtists(); if err != nil {
+        return
+    }
+
+    indexes = &SubsonicIndexes{
+        LastModified:   cs.songsMtime,
+        Index:          idx,
+    }
+
+    return
+}
+
+// returns a list of all albums for a given artist id
+func (cs *CatalogSnapshot) GetArtist(id string) (sr *SubsonicArtist, err error) {
+    var idx         uint32
+    var ok          bool
+    var off         uint64
+    var firstAlbum  uint32
+    var albumCount  uint32
+    var albums      []*SubsonicAlbum
+
+    idx, ok = cs.lookup(cs.artistIdsOff, cs.artistCount, id); if !ok {
+        err = ErrItemNotFound
+        return
+    }
+
+    off         = cs.artistsOff + uint64(idx) * SNAPSHOT_ARTIST_SIZE
+    firstAlbum  = le.Uint32(cs.data[off + 16:])
+    albumCount  = le.Uint32(cs.data[off + 20:])
+
+    if albumCount > 0 && (firstAlbum >= cs.albumCount || albumCount > cs.albumCount - firstAlbum) {
+        err = ErrBadSnapshot
+        return
+    }
+
+    albums = make([]*SubsonicAlbum, 0, albumCount)
+    for i := firstAlbum; i < firstAlbum + albumCount; i++ {
+        albums = append(albums, cs.album(i))
+    }
+
+    sr = &SubsonicArtist{
+        Id:         le.Uint64(cs.data[off:]),
+        Name:       cs.str(off + 8),
+        CoverArt:   fmt.Sprintf("ar-%v", le.Uint64(cs.data[off:])),
+        AlbumCount: uint64(albumCount),
+        Albums:     albums,
+    }
+
+    return
+}
+
+// returns a list of all songs for a given album id
+func (cs *CatalogSnapshot) GetAlbum(id string) (sr *SubsonicAlbum, err error) {
+    var idx         uint32
+    var ok          bool
+    var off         uint64
+    var firstSong   uint32
+    var songs       []*SubsonicSong
+
+    idx, ok = cs.lookup(cs.albumIdsOff, cs.albumCount, id); if !ok {
+        err = ErrItemNotFound
+        return
+    }
+
+    sr          = cs.album(idx)
+    off         = cs.albumsOff + uint64(idx) * SNAPSHOT_ALBUM_SIZE
+    firstSong   = le.Uint32(cs.data[off + 32:])
+
+    if sr.SongCount > 0 && (firstSong >= cs.songCount || sr.SongCount > uint64(cs.songCount - firstSong)) {
+        err = ErrBadSnapshot
+        return
+    }
+
+    songs = make([]*SubsonicSong, 0, sr.SongCount)
+    for i := firstSong; i < firstSong + uint32(sr.SongCount); i++ {
+        songs = append(songs, cs.song(i))
+    }
+
+    sr.Songs = &songs
+    return
+}
+
+// returns a single song
+func (cs *CatalogSnapshot) GetSong(id string) (ss *SubsonicSong, err error) {
+    var idx uint32
+    var ok  bool
+
+    idx, ok = cs.lookup(cs.songIdsOff, cs.songCount, id); if !ok {
+        err = ErrItemNotFound
+        return
+    }
+
+    ss = cs.song(idx)
+    return
+}
+
+func (cs *CatalogSnapshot) album(idx uint32) (sa *SubsonicAlbum) {
+    var off = cs.albumsOff + uint64(idx) * SNAPSHOT_ALBUM_SIZE
+
+    sa = &SubsonicAlbum{
+        Id:         le.Uint64(cs.data[off:]),
+        ArtistId:   le.Uint64(cs.data[off + 8:]),
+        Name:       cs.str(off + 16),
+        ArtistName: cs.str(off + 24),
+        SongCount:  uint64(le.Uint32(cs.data[off + 36:])),
+        Duration:   uint64(le.Uint32(cs.data[off + 40:])),
+        CoverArt:   fmt.Sprintf("al-%v", le.Uint64(cs.data[off:])),
+    }
+
+    return
+}
+
+func (cs *CatalogSnapshot) song(idx uint32) (s *SubsonicSong) {
+    var off = cs.songsOff + uint64(idx) * SNAPSHOT_SONG_SIZE
+
+    s = &SubsonicSong{
+        Id:         le.Uint64(cs.data[off:]),
+        AlbumId:    le.Uint64(cs.data[off + 8:]),
+        ArtistId:   le.Uint64(cs.data[off + 16:]),
+        Title:      cs.str(off + 24),
+        Album:      cs.str(off + 32),
+        Artist:     cs.str(off + 40),
+        Genre:      cs.str(off + 48),
+        Type:       cs.str(off + 56),
+        TrackNo:    uint64(le.Uint32(cs.data[off + 72:])),
+        Duration:   uint64(le.Uint32(cs.data[off + 84:])),
+        BitRate:    uint64(le.Uint32(cs.data[off + 88:])),
+    }
+    // discn is unused, same as in scanSong()
+    setSongPath(s, uint64(le.Uint32(cs.data[off + 80:])), cs.str(off + 64))
+
+    return
+}
+
+// keeps track of the latest snapshot published by the indexer and swaps it
+// in when it changes on disk
+type SnapshotStore struct {
+    logger      *log.Logger
+    path        string
+    lock        sync.RWMutex
+    snapshot    *CatalogSnapshot
+    finfo       os.FileInfo
+}
+
+// creates a new SnapshotStore for the snapshot file at path
+func NewSnapshotStore(logger *log.Logger, path string) (ss *SnapshotStore) {
+    ss = &SnapshotStore{
+        logger:     logger,
+        path:       path,
+    }
+
+    return
+}
+
+// runs fn against the current snapshot, if any. returns false when no
+// snapshot is loaded, in which case callers should fall back to the database.
+func (ss *SnapshotStore) View(fn func(cs *CatalogSnapshot)) (ok bool) {
+    ss.lock.RLock()
+    defer ss.lock.RUnlock()
+
+    if ss.snapshot == nil {
+        return false
+    }
+
+    fn(ss.snapshot)
+    return true
+}
+
+// (re)loads the snapshot file if it was replaced since the last call
+func (ss *SnapshotStore) Reload() {
+    var finfo   os.FileInfo
+    var cs      *CatalogSnapshot
+    var old     *CatalogSnapshot
+    var err     error
+
+    finfo, err = os.Stat(ss.path)
+    if err != nil {
+        finfo = nil
+    }
+
+    // nothing changed since we last looked
+    if finfo == nil && ss.finfo == nil {
+        return
+    }
+    if finfo != nil && ss.finfo != nil && os.SameFile(finfo, ss.finfo) &&
+       finfo.ModTime().Equal(ss.finfo.ModTime()) && finfo.Size() == ss.finfo.Size() {
+        return
+    }
+
+    if finfo != nil {
+        cs, err = OpenCatalogSnapshot(ss.path); if err != nil {
+            ss.logger.Printf("failed to load snapshot %s: %v", ss.path, err)
+            cs = nil
+        } else {
+            ss.logger.Printf("loaded snapshot %s (%v artists, %v albums, %v songs)",
+                             ss.path, cs.artistCount, cs.albumCount, cs.songCount)
+        }
+    }
+
+    // swap snapshots, unmapping the old one once no reader uses it anymore
+    ss.lock.Lock()
+    old         = ss.snapshot
+    ss.snapshot = cs
+    ss.finfo    = finfo
+    ss.lock.Unlock()
+
+    if old != nil {
+        old.Close()
+    }
+
+    return
+}
+
+// loads the snapshot and keeps polling for new ones in the background
+func (ss *SnapshotStore) Watch(interval time.Duration) {
+    ss.Reload()
+
+    go func() {
+        for range time.Tick(interval) {
+            ss.Reload()
+        }
+    }()
+
+    return
+}